@@ -0,0 +1,474 @@
+/**
+ * rrimagelib性能测试，用于复现提交说明中的耗时数据
+ *
+ * <p>
+ * 用法：./bench [测试项]，不带参数时运行所有测试项。
+ * 测试图片在内存中生成（平滑渐变加少量噪声，接近照片的压缩率），不依赖外部文件。
+ * 每项取多次运行中的最小值，单位毫秒
+ * </p>
+ */
+
+#include <string.h>
+
+#include "rrimagelib.h"
+
+// 单调时钟，单位毫秒
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * 生成测试图片：每个通道为横竖两个方向的渐变叠加，再加上[-8, 8)的伪随机噪声
+ *
+ * @param channels 1、3或4，4通道时alpha为255
+ */
+static rrimage *make_image(int width, int height, int channels) {
+    rrimage *data = init_rrimage();
+    data->width = width;
+    data->height = height;
+    data->channels = channels;
+    data->stride = width * channels;
+    data->pixels = (unsigned char *) malloc((size_t) data->stride * height);
+    if (!data->pixels) {
+        free_rrimage(data);
+        return NULL;
+    }
+
+    unsigned int seed = 20121109;
+    int x, y, c;
+    for (y = 0; y < height; y++) {
+        unsigned char *row = data->pixels + (size_t) y * data->stride;
+        for (x = 0; x < width; x++) {
+            for (c = 0; c < channels; c++) {
+                if (c == 3) {
+                    row[x * channels + c] = 255;
+                    continue;
+                }
+                seed = seed * 1103515245 + 12345;
+                int value = (x * (c + 1) * 255 / width + y * (3 - c) * 255
+                        / height) / 3 + 40 + (int) (seed >> 28) - 8;
+                row[x * channels + c] = (unsigned char) CLAMP(value);
+            }
+        }
+    }
+
+    return data;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double min_time(double *times, int runs) {
+    qsort(times, runs, sizeof(double), compare_double);
+    return times[0];
+}
+
+/**
+ * user-027：90/270度旋转的分块转置，1/12/48 MP，3通道和4通道，180度和镜像作为对照
+ *
+ * <p>
+ * 3通道的SSSE3转置需要用make CFLAGS="-O2 -mssse3"编译，否则只有SSE2
+ * </p>
+ */
+static void bench_rotate() {
+    static const int sizes[][2] = { { 1152, 864 }, { 4000, 3000 },
+            { 8000, 6000 } };
+    static const int orientations[] = { ROTATE_90, ROTATE_270, ROTATE_180,
+            FLIP_ROTATE_0 };
+    static const char *names[] = { "ROTATE_90", "ROTATE_270", "ROTATE_180",
+            "FLIP_ROTATE_0" };
+    int runs = 5;
+    double times[5];
+
+    printf("\n== rotate: flip_or_rotate ==\n");
+    printf("| size      | ch | orientation   |      ms |   MB/s |\n");
+    unsigned int i, j;
+    int channels, k;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        for (channels = 3; channels <= 4; channels++) {
+            rrimage *data = make_image(sizes[i][0], sizes[i][1], channels);
+            if (!data) {
+                printf("out of memory...\n");
+                return;
+            }
+            double bytes = (double) data->stride * data->height;
+            for (j = 0; j < sizeof(orientations) / sizeof(orientations[0]);
+                    j++) {
+                for (k = 0; k < runs; k++) {
+                    double start = now_ms();
+                    flip_or_rotate(data, orientations[j]);
+                    times[k] = now_ms() - start;
+                }
+                double ms = min_time(times, runs);
+                printf("| %4dx%-4d | %2d | %-13s | %7.2f | %6.0f |\n",
+                        sizes[i][0], sizes[i][1], channels, names[j], ms,
+                        bytes / 1048576 / (ms / 1000));
+            }
+            free_rrimage(data);
+        }
+    }
+}
+
+static void put_le32(unsigned char *p, unsigned int value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+/**
+ * 编码为bmp：write_bmp只输出24位图，32位图在这里按BGRA、从下到上拼出来
+ */
+static int encode_bmp(rrimage *data, rrimage_encoded *result) {
+    if (data->channels != 4) {
+        return write_bmp_to_memory(data, result);
+    }
+
+    size_t stride = (size_t) data->width * 4;
+    result->size = 54 + stride * data->height;
+    result->buffer = (unsigned char *) calloc(result->size, 1);
+    if (!result->buffer) {
+        return 0;
+    }
+    unsigned char *header = result->buffer;
+    header[0] = 'B';
+    header[1] = 'M';
+    put_le32(header + 2, (unsigned int) result->size);
+    put_le32(header + 10, 54);
+    put_le32(header + 14, 40);
+    put_le32(header + 18, data->width);
+    put_le32(header + 22, data->height);
+    header[26] = 1;
+    header[28] = 32;
+
+    unsigned int x, y;
+    for (y = 0; y < data->height; y++) {
+        const unsigned char *src = data->pixels + (size_t) y * data->stride;
+        unsigned char *dst = header + 54 + (data->height - 1 - y) * stride;
+        for (x = 0; x < data->width; x++) {
+            dst[x * 4] = src[x * 4 + 2];
+            dst[x * 4 + 1] = src[x * 4 + 1];
+            dst[x * 4 + 2] = src[x * 4];
+            dst[x * 4 + 3] = src[x * 4 + 3];
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * user-031：24位和32位bmp整行读取加SIMD交换BGR，24 MP，按文件字节数计算MB/s
+ *
+ * <p>
+ * read_bmp从临时文件读取（在页缓存中），32位图包含strip_alpha的耗时
+ * </p>
+ */
+static void bench_bmp() {
+    const char *path = "rrimagelib_bench.bmp";
+    int runs = 7;
+    double times[7];
+    rrimage_encoded bmp[2];
+
+    // write_bmp会输出日志，先编码好两张图再输出表格
+    int i, k, from_file;
+    for (i = 0; i < 2; i++) {
+        rrimage *data = make_image(5657, 4243, i + 3);
+        if (!data || !encode_bmp(data, &bmp[i])) {
+            printf("out of memory...\n");
+            free_rrimage(data);
+            if (i) {
+                free(bmp[0].buffer);
+            }
+            return;
+        }
+        free_rrimage(data);
+    }
+
+    printf("\n== bmp: read_bmp / read_bmp_from_memory, 5657x4243 ==\n");
+    printf("| bpp | source |      ms |   MB/s |\n");
+    for (i = 0; i < 2; i++) {
+        FILE *fp = fopen(path, "wb");
+        if (!fp || fwrite(bmp[i].buffer, 1, bmp[i].size, fp) != bmp[i].size) {
+            printf("write %s error...\n", path);
+            if (fp) {
+                fclose(fp);
+            }
+            break;
+        }
+        fclose(fp);
+
+        for (from_file = 1; from_file >= 0; from_file--) {
+            for (k = 0; k < runs; k++) {
+                double start = now_ms();
+                rrimage *data = from_file ? read_bmp(path)
+                        : read_bmp_from_memory(bmp[i].buffer, bmp[i].size);
+                times[k] = now_ms() - start;
+                free_rrimage(data);
+            }
+            double ms = min_time(times, runs);
+            printf("| %3d | %-6s | %7.2f | %6.0f |\n", (i + 3) * 8,
+                    from_file ? "file" : "memory", ms,
+                    bmp[i].size / 1048576.0 / (ms / 1000));
+        }
+    }
+    remove(path);
+    free(bmp[0].buffer);
+    free(bmp[1].buffer);
+}
+
+/**
+ * 生成测试图片并按quality编码为jpeg（4:2:0）
+ *
+ * @param restart_interval 每多少个MCU插入一个RST标记，0为不插入
+ */
+static int make_jpeg(int width, int height, int channels, int quality,
+        int restart_interval, rrimage_encoded *result) {
+    rrimage *data = make_image(width, height, channels);
+    if (!data) {
+        return 0;
+    }
+    rrimage_jpeg_options options;
+    init_jpeg_options(&options, JPEG_PRESET_DEFAULT);
+    options.restart_interval = restart_interval;
+    data->quality = quality;
+    int ret = write_jpeg_to_memory_with_options(data, &options, result);
+    free_rrimage(data);
+    return ret;
+}
+
+/**
+ * user-041：jpeg缩略图在YCbCr平面上转码，与解码为RGB后重新编码对比，质量80
+ */
+static void bench_transcode() {
+    static const int cases[][3] = { { 4000, 3000, 1000 }, { 1600, 1200, 700 },
+            { 4000, 3000, 300 } };
+    int runs = 15;
+    double times[2][15];
+
+    printf("\n== transcode: transcode_jpeg_by_area vs RGB decode + encode ==\n");
+    printf("| source    | min_width |  planar |     rgb |\n");
+    unsigned int i;
+    int k;
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        rrimage_encoded jpeg;
+        if (!make_jpeg(cases[i][0], cases[i][1], 3, 90, 0, &jpeg)) {
+            printf("encode jpeg error...\n");
+            return;
+        }
+
+        // 两种方式交替运行，减少机器负载变化的影响
+        for (k = 0; k < runs; k++) {
+            rrimage_encoded out;
+            double start = now_ms();
+            if (transcode_jpeg_by_area_from_memory(jpeg.buffer, jpeg.size,
+                    compress_strategy, cases[i][2], 0, 0, 0, 0, ROTATE_0, 80,
+                    &out)) {
+                free(out.buffer);
+            }
+            times[0][k] = now_ms() - start;
+
+            start = now_ms();
+            rrimage *data = read_image_with_compress_by_area_from_memory(
+                    jpeg.buffer, jpeg.size, compress_strategy, cases[i][2], 0,
+                    0, 0, 0, ROTATE_0);
+            if (data) {
+                data->quality = limit_jpeg_quality(data, 80);
+                if (write_jpeg_to_memory(data, &out)) {
+                    free(out.buffer);
+                }
+                free_rrimage(data);
+            }
+            times[1][k] = now_ms() - start;
+        }
+        printf("| %4dx%-4d | %9d | %7.2f | %7.2f |\n", cases[i][0],
+                cases[i][1], cases[i][2], min_time(times[0], runs),
+                min_time(times[1], runs));
+        free(jpeg.buffer);
+    }
+}
+
+// RGB（或RGBA的前三个通道）的峰值信噪比，完全相同时返回99
+static double psnr(const rrimage *a, const rrimage *b) {
+    double sum = 0;
+    size_t count = 0;
+    unsigned int x, y, c;
+    int channels = MIN(a->channels, 3);
+    for (y = 0; y < a->height; y++) {
+        const unsigned char *pa = a->pixels + (size_t) y * a->stride;
+        const unsigned char *pb = b->pixels + (size_t) y * b->stride;
+        for (x = 0; x < a->width; x++) {
+            for (c = 0; c < (unsigned int) channels; c++) {
+                double d = pa[x * a->channels + c] - pb[x * b->channels + c];
+                sum += d * d;
+            }
+        }
+        count += (size_t) a->width * channels;
+    }
+    return sum > 0 ? 10 * log10(255.0 * 255.0 * count / sum) : 99;
+}
+
+/**
+ * user-045：DECODE_MODE_DRAFT与默认质量模式对比，RGBA输出，短边0（不缩放）/1080/320，
+ * PSNR为草稿模式相对质量模式
+ */
+static void bench_draft() {
+    static const int sources[][3] = { { 8000, 6000, 3 }, { 4000, 3000, 3 },
+            { 1600, 1200, 3 }, { 1600, 1200, 1 } };
+    static const int min_widths[] = { 0, 1080, 320 };
+    int runs = 9;
+    double times[2][9];
+
+    printf("\n== draft: DECODE_MODE_DRAFT vs DECODE_MODE_QUALITY, RGBA ==\n");
+    printf("| source      | output    | quality |   draft | speedup | PSNR |\n");
+    unsigned int i, j;
+    int k, mode;
+    for (i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        rrimage_encoded jpeg;
+        if (!make_jpeg(sources[i][0], sources[i][1], sources[i][2], 90, 0,
+                &jpeg)) {
+            printf("encode jpeg error...\n");
+            return;
+        }
+
+        for (j = 0; j < sizeof(min_widths) / sizeof(min_widths[0]); j++) {
+            rrimage *out[2] = { NULL, NULL };
+            for (k = 0; k < runs; k++) {
+                for (mode = 0; mode < 2; mode++) {
+                    double start = now_ms();
+                    rrimage *data =
+                            read_image_with_compress_by_area_from_memory_in_format(
+                                    jpeg.buffer, jpeg.size,
+                                    min_widths[j] ? compress_strategy : NULL,
+                                    min_widths[j], 0, 0, 0, 0, ROTATE_0,
+                                    PIXEL_FORMAT_RGBA8888
+                                            | (mode ? DECODE_MODE_DRAFT : 0));
+                    times[mode][k] = now_ms() - start;
+                    free_rrimage(out[mode]);
+                    out[mode] = data;
+                }
+            }
+            if (!out[0] || !out[1]) {
+                printf("decode jpeg error...\n");
+            } else {
+                double quality = min_time(times[0], runs);
+                double draft = min_time(times[1], runs);
+                printf("| %4dx%-4d %s | %4dx%-4d | %7.2f | %7.2f | %6.2fx | %4.1f |\n",
+                        sources[i][0], sources[i][1],
+                        sources[i][2] == 1 ? "g" : " ", out[0]->width,
+                        out[0]->height, quality, draft, quality / draft,
+                        psnr(out[0], out[1]));
+            }
+            free_rrimage(out[0]);
+            free_rrimage(out[1]);
+        }
+        free(jpeg.buffer);
+    }
+}
+
+/**
+ * user-047：有RST标记的大图分带并行解码，与没有RST标记的同一张图（顺序解码）对比，RGB输出
+ *
+ * <p>
+ * 分带的线程数不超过CPU核数，单核时不会分带，两列都是顺序解码。
+ * 用make bench CPPFLAGS=-DRR_FORCE_THREADS=4编译可以在单核上强制分成4带，测量分带本身的开销
+ * </p>
+ */
+static void bench_parallel() {
+    static const int min_widths[] = { 0, 1080 };
+    int runs = 7;
+    double times[2][7];
+    rrimage_encoded jpeg[2];
+
+    // 8000x6000的4:2:0图每个MCU行500个MCU，每行一个重启间隔
+    int i, k;
+    for (i = 0; i < 2; i++) {
+        if (!make_jpeg(8000, 6000, 3, 90, i ? 500 : 0, &jpeg[i])) {
+            printf("encode jpeg error...\n");
+            if (i) {
+                free(jpeg[0].buffer);
+            }
+            return;
+        }
+    }
+
+#ifdef RR_FORCE_THREADS
+    printf("\n== parallel: 8000x6000, RR_FORCE_THREADS=%d ==\n",
+            RR_FORCE_THREADS);
+#else
+    printf("\n== parallel: 8000x6000, threads by CPU count ==\n");
+#endif
+    printf("| output    |  no RST |     RST |\n");
+    unsigned int j;
+    for (j = 0; j < sizeof(min_widths) / sizeof(min_widths[0]); j++) {
+        int width = 0;
+        int height = 0;
+        for (k = 0; k < runs; k++) {
+            for (i = 0; i < 2; i++) {
+                double start = now_ms();
+                rrimage *data = read_image_with_compress_by_area_from_memory(
+                        jpeg[i].buffer, jpeg[i].size,
+                        min_widths[j] ? compress_strategy : NULL,
+                        min_widths[j], 0, 0, 0, 0, ROTATE_0);
+                times[i][k] = now_ms() - start;
+                if (data) {
+                    width = data->width;
+                    height = data->height;
+                }
+                free_rrimage(data);
+            }
+        }
+        printf("| %4dx%-4d | %7.2f | %7.2f |\n", width, height,
+                min_time(times[0], runs), min_time(times[1], runs));
+    }
+    free(jpeg[0].buffer);
+    free(jpeg[1].buffer);
+}
+
+typedef struct {
+    const char *name;
+    void (*run)();
+} bench_item;
+
+static const bench_item items[] = {
+    { "rotate", bench_rotate },
+    { "bmp", bench_bmp },
+    { "transcode", bench_transcode },
+    { "draft", bench_draft },
+    { "parallel", bench_parallel },
+};
+
+int main(int argc, char *argv[]) {
+    unsigned int i;
+    int j, found;
+    for (j = 1; j < argc; j++) {
+        found = 0;
+        for (i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+            found |= !strcmp(argv[j], items[i].name);
+        }
+        if (!found) {
+            printf("usage: %s [", argv[0]);
+            for (i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+                printf(i ? "|%s" : "%s", items[i].name);
+            }
+            printf("] ...\n");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(items) / sizeof(items[0]); i++) {
+        found = argc == 1;
+        for (j = 1; j < argc; j++) {
+            found |= !strcmp(argv[j], items[i].name);
+        }
+        if (found) {
+            items[i].run();
+        }
+    }
+
+    return 0;
+}
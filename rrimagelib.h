@@ -18,6 +18,7 @@ extern "C" {
 #include <setjmp.h>
 #include <math.h>
 #include <png.h>
+#include <zlib.h>
 #include <jpeglib.h>
 
 #include "libnsgif.h"
@@ -34,6 +35,29 @@ extern "C" {
 #define TYPE_RRIMAGE_BMP 3
 #define TYPE_RRIMAGE_GIF 4
 
+// 输出像素格式
+#define PIXEL_FORMAT_DEFAULT 0 // 与read_image_with_compress_by_area的结果相同，灰度图为单通道GRAY，带alpha时为RGBA
+#define PIXEL_FORMAT_RGB888 1 // RGB，灰度图扩展为RGB，带alpha的图片叠加到白色背景上
+#define PIXEL_FORMAT_RGBA8888 2 // RGBA，不带alpha的图片alpha为255
+#define PIXEL_FORMAT_BGRA8888 3 // BGRA
+#define PIXEL_FORMAT_RGBA8888_PREMULTIPLIED 4 // RGBA，RGB已乘以alpha
+#define PIXEL_FORMAT_BGRA8888_PREMULTIPLIED 5 // BGRA，RGB已乘以alpha
+#define PIXEL_FORMAT_RGB565 6 // 16位RGB565，按本机字节序存储，带alpha的图片叠加到白色背景上
+#define PIXEL_FORMAT_GRAY8 7 // 8位灰度（BT.601），带alpha的图片叠加到白色背景上
+#define PIXEL_FORMAT_MASK 0xff
+
+// 解码模式，与PIXEL_FORMAT_*按位或后作为format传入（如PIXEL_FORMAT_RGBA8888 | DECODE_MODE_DRAFT）
+#define DECODE_MODE_QUALITY 0x000 // 默认，质量优先
+#define DECODE_MODE_DRAFT 0x100 // 预览用，速度优先：jpeg使用快速整数IDCT、不做块平滑，其他格式与质量模式相同
+#define DECODE_MODE_MASK 0xf00
+
+// 渐进式jpeg只解码前n次扫描作为低分辨率预览（n为1~255），同样与PIXEL_FORMAT_*按位或后传入。
+// 至少解码到所有颜色分量都有了DC系数，DECODE_SCANS(1)即第一次可用的扫描；0解码全部扫描，非渐进式图片忽略
+#define DECODE_SCANS_SHIFT 12
+#define DECODE_SCANS_MASK 0xff000
+#define DECODE_SCANS(n) (((n) << DECODE_SCANS_SHIFT) & DECODE_SCANS_MASK)
+#define DECODE_FIRST_SCAN DECODE_SCANS(1)
+
 // 压缩常量
 #define COMPRESS_MAX_WIDTH 1600
 #define COMPRESS_MIN_WIDTH 960
@@ -75,9 +99,74 @@ typedef struct {
     unsigned int stride;//一行字节数，一般为宽＊通道
     unsigned char *pixels;
     unsigned char type;// 图片源为jpeg格式或png格式，TYPE_RRIMAGE_JPEG表示jpeg，TYPE_RRIMAGE_PNG表示png，TYPE_RRIMAGE_UNSPECIFIED表示未知
-    unsigned char quality;// 图片质量
+    unsigned char quality;// 图片质量，解码jpeg时为按量化表估算的原图质量，其他格式为100
+    unsigned char format;// 像素格式PIXEL_FORMAT_*，PIXEL_FORMAT_DEFAULT表示按channels为GRAY、RGB或RGBA
 }rrimage;
 
+// 图片基本信息，由probe_image读取文件头得到，不解码像素
+typedef struct {
+    unsigned int width;
+    unsigned int height;
+    unsigned int channels; // 原图通道数，调色板图按解码后的通道数计算
+    unsigned int bit_depth; // 每个通道的位数
+    unsigned int frame_count; // gif的帧数，其他格式为1
+    int orientation; // jpeg的EXIF方向（ROTATE_*），没有时为ROTATE_0
+    int quality; // jpeg按量化表估算的质量（1~100），其他格式为0
+    unsigned char type; // TYPE_RRIMAGE_*
+} rrimage_info;
+
+// 调用方提供的输出缓冲区，解码结果直接写入pixels
+typedef struct {
+    unsigned char *pixels;
+    unsigned int stride; // 一行的字节数，0表示紧密排列（宽 * 每像素字节数）
+    size_t capacity; // pixels可写入的总字节数
+    int format; // PIXEL_FORMAT_*，可按位或DECODE_MODE_*
+} rrimage_buffer;
+
+/**
+ * 编码输出回调，编码过程中会被多次调用，每次传入一段连续的编码数据
+ *
+ * @return 成功返回1，返回0时中止编码
+ */
+typedef int (*RR_WRITE_CALLBACK)(void *user_data, const unsigned char *buffer,
+        size_t size);
+
+// 编码结果
+typedef struct {
+    unsigned char *buffer; // 编码到内存时的数据，使用后需free；输出到回调时为NULL
+    size_t size; // 编码后的字节数
+    double encode_time; // 编码耗时，单位毫秒
+} rrimage_encoded;
+
+// jpeg编码的色度采样
+#define JPEG_SUBSAMPLING_420 0 // 色度宽高各取一半，文件最小，默认
+#define JPEG_SUBSAMPLING_444 1 // 不做色度采样，红色文字、细线等色彩边缘更清晰，文件更大
+
+// jpeg编码参数预设，用于init_jpeg_options
+// 没有单独的最快预设：默认参数已经是最快的（libjpeg-turbo的精确整数DCT有SIMD实现，JDCT_IFAST并不更快）
+#define JPEG_PRESET_DEFAULT 0 // 与不传编码参数时相同：基线、标准霍夫曼表、精确整数DCT、4:2:0，编码最快
+#define JPEG_PRESET_SMALLEST 1 // 文件最小，用于CDN分发：优化霍夫曼表，文件小约4%~12%，编码耗时约为默认的2倍
+
+// jpeg编码参数，质量仍由rrimage的quality或quality参数指定，先用init_jpeg_options按预设初始化再修改需要的项
+typedef struct {
+    int optimize_coding; // 非0时为每张图片统计生成最优的霍夫曼表（多一遍熵编码），文件小约4%~12%，不影响画质
+    // 非0时输出渐进式jpeg（同时会优化霍夫曼表），解码端可以先显示低分辨率图像。与只优化霍夫曼表相比，
+    // 实测小的照片小约6%，大图和平滑图片反而大4%~5%，编码耗时约为其2倍
+    int progressive;
+    J_DCT_METHOD dct_method; // JDCT_ISLOW精确整数，JDCT_IFAST快速整数（精度略低，高质量时有可见误差），JDCT_FLOAT浮点
+    int subsampling; // JPEG_SUBSAMPLING_*，灰度图忽略
+    int restart_interval; // 每多少个MCU插入一个RST标记，0为不插入；有RST标记的大图解码时可以分带并行解码
+} rrimage_jpeg_options;
+
+// png编码参数，先用init_png_options初始化为与write_png相同的默认值再修改需要的项
+typedef struct {
+    int level; // zlib压缩级别0~9，Z_DEFAULT_COMPRESSION为zlib默认（6）；1~3比默认快数倍，文件稍大
+    int strategy; // zlib策略Z_FILTERED、Z_RLE等，-1按libpng默认（使用过滤时为Z_FILTERED）
+    int filters; // 行过滤PNG_FILTER_*按位或：多种时每行选择效果最好的一种（PNG_ALL_FILTERS为libpng默认），只有一种时所有行固定使用
+    int keep_alpha; // 非0时带alpha的图片输出RGBA，否则与write_png相同叠加到白色背景上输出RGB
+    int threads; // 压缩线程数，0为按CPU核数，1不并行；大图分成多个行带并行压缩（同pigz），输出仍是一个zlib流
+} rrimage_png_options;
+
 typedef struct my_error_mgr {
     struct jpeg_error_mgr pub;
     jmp_buf setjmp_buffer;
@@ -96,37 +185,168 @@ void strip_alpha(rrimage *);
 
 int check_file_type(FILE *);
 
+/**
+ * 根据内存中的文件头判断图片类型
+ */
+int check_buffer_type(const unsigned char *buffer, size_t size);
+
 void my_error_exit(j_common_ptr cinfo);
 
 void my_output_message(j_common_ptr cinfo);
 
 rrimage* read_jpeg(const char *);
 
+/**
+ * 从内存中的jpeg文件数据解码，以下*_from_memory函数均不会修改或保留buffer
+ */
+rrimage* read_jpeg_from_memory(const unsigned char *buffer, size_t size);
+
 int write_jpeg(const char *, rrimage *);
 
+/**
+ * 编码到内存，以下*_to_memory函数成功时result->buffer需由调用方free
+ */
+int write_jpeg_to_memory(rrimage *data, rrimage_encoded *result);
+
+/**
+ * 编码数据通过callback输出（如直接写入socket或缓存），以下*_to_callback函数的result可以为NULL
+ */
+int write_jpeg_to_callback(rrimage *data, RR_WRITE_CALLBACK callback,
+        void *user_data, rrimage_encoded *result);
+
+/**
+ * 按预设初始化jpeg编码参数
+ *
+ * @param preset JPEG_PRESET_*，未知的预设按JPEG_PRESET_DEFAULT
+ */
+void init_jpeg_options(rrimage_jpeg_options *options, int preset);
+
+/**
+ * 同write_jpeg，按options编码，options为NULL时与write_jpeg相同
+ */
+int write_jpeg_with_options(const char *file_name, rrimage *data,
+        const rrimage_jpeg_options *options);
+
+int write_jpeg_to_memory_with_options(rrimage *data,
+        const rrimage_jpeg_options *options, rrimage_encoded *result);
+
+int write_jpeg_to_callback_with_options(rrimage *data,
+        const rrimage_jpeg_options *options, RR_WRITE_CALLBACK callback,
+        void *user_data, rrimage_encoded *result);
+
+// 按大小限制编码时最多试编码的次数，插值查找在1~100之间一般6次左右即可收敛到相邻的质量
+#define JPEG_SIZE_MAX_TRIALS 10
+
+/**
+ * 按字节数上限编码jpeg：先按data->quality编码，超过max_size时在更低的质量中查找，返回不超过max_size的最高质量的结果。
+ * 试编码都在内存中进行并共用同一个编码器，RGB只转换一次YCbCr，最多试编码JPEG_SIZE_MAX_TRIALS次
+ *
+ * @param options 编码参数，可以为NULL
+ * @param quality 不为NULL时返回实际使用的质量
+ * @return 成功返回1，质量为1时仍超过max_size或编码失败返回0
+ */
+int write_jpeg_to_memory_within_size(rrimage *data,
+        const rrimage_jpeg_options *options, size_t max_size, int *quality,
+        rrimage_encoded *result);
+
+/**
+ * 同write_jpeg_to_memory_within_size，结果写入文件，失败时不保留文件
+ */
+int write_jpeg_within_size(const char *file_name, rrimage *data,
+        const rrimage_jpeg_options *options, size_t max_size, int *quality);
+
 rrimage* read_png(const char *);
 
+rrimage* read_png_from_memory(const unsigned char *buffer, size_t size);
+
 int write_png(const char *, rrimage *);
 
+int write_png_to_memory(rrimage *data, rrimage_encoded *result);
+
+int write_png_to_callback(rrimage *data, RR_WRITE_CALLBACK callback,
+        void *user_data, rrimage_encoded *result);
+
+void init_png_options(rrimage_png_options *options);
+
+/**
+ * 同write_png，按options编码，options为NULL时与write_png相同
+ *
+ * <p>
+ * threads不为1且图片足够大时按行分带，各线程独立完成行过滤和deflate（以前一带末尾的32K数据作为预设字典，
+ * 压缩率与单线程接近），按顺序拼接为一个zlib流写入IDAT
+ * </p>
+ */
+int write_png_with_options(const char *file_name, rrimage *data,
+        const rrimage_png_options *options);
+
+int write_png_to_memory_with_options(rrimage *data,
+        const rrimage_png_options *options, rrimage_encoded *result);
+
+int write_png_to_callback_with_options(rrimage *data,
+        const rrimage_png_options *options, RR_WRITE_CALLBACK callback,
+        void *user_data, rrimage_encoded *result);
+
 /**
  * 暂未处理RLE4和RLE8压缩的图像，有需求再加入
  */
 rrimage* read_bmp(const char *);
 
+rrimage* read_bmp_from_memory(const unsigned char *buffer, size_t size);
+
 /**
  * gif图一般不会很大，不考虑超大图的情况
  */
 rrimage* read_gif(const char *file_path);
 
+rrimage* read_gif_from_memory(const unsigned char *buffer, size_t size);
+
 /**
  * 默认写入的bmp文件均为24位图像
  */
 int write_bmp(const char *, rrimage *);
 
+int write_bmp_to_memory(rrimage *data, rrimage_encoded *result);
+
+int write_bmp_to_callback(rrimage *data, RR_WRITE_CALLBACK callback,
+        void *user_data, rrimage_encoded *result);
+
 rrimage* read_image(const char *);
 
+/**
+ * 根据文件头自动判断格式，从内存中解码图片
+ */
+rrimage* read_image_from_memory(const unsigned char *buffer, size_t size);
+
+/**
+ * 只读取文件头，获取图片的宽高、格式、通道数、位深、gif帧数和jpeg的EXIF方向、质量，
+ * 用于解码前预估内存和选择min_width
+ *
+ * @return 成功返回1，格式不支持或文件头错误返回0
+ */
+int probe_image(const char *file_name, rrimage_info *info);
+
+int probe_image_from_memory(const unsigned char *buffer, size_t size,
+        rrimage_info *info);
+
+/**
+ * jpeg编码质量策略：取原图质量data->quality和目标质量quality中较小的一个。
+ * 原图质量较低时按更高的质量重新编码只会增大文件，画质并不会更好
+ */
+int limit_jpeg_quality(const rrimage *data, int quality);
+
+/**
+ * 统一以jpeg格式输出，质量为limit_jpeg_quality(data, 80)
+ */
 int write_image(const char *, rrimage *);
 
+/**
+ * 同write_image，统一以jpeg格式编码到内存
+ */
+int write_image_to_memory(rrimage *data, rrimage_encoded *result);
+
+int write_image_to_callback(rrimage *data, RR_WRITE_CALLBACK callback,
+        void *user_data, rrimage_encoded *result);
+
 /**
  * 按照需求读取大图片并压缩到合适的大小
  *
@@ -159,6 +379,161 @@ rrimage* read_image_with_compress_by_area(const char *file_path,
         COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
         int rotate);
 
+/**
+ * 同read_image_with_compress_by_area，输出指定的像素格式，格式转换在缩放写入时完成
+ *
+ * <p>
+ * PIXEL_FORMAT_RGBA8888以外的格式（BGRA、预乘alpha、RGB565、GRAY8）只用于显示，不能再用write_*编码
+ * </p>
+ *
+ * @param format 输出像素格式PIXEL_FORMAT_*，rrimage的channels为每像素字节数，
+ *            按位或DECODE_MODE_DRAFT时以较低的画质换取解码速度，按位或DECODE_SCANS(n)时
+ *            渐进式jpeg只解码前n次扫描，都用于预览
+ */
+rrimage* read_image_with_compress_by_area_in_format(const char *file_path,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int format);
+
+/**
+ * 同read_image_with_compress_by_area，图片数据来自内存（如网络下载的数据），不需要写入临时文件
+ *
+ * @param buffer 完整的图片文件数据
+ * @param size buffer的字节数
+ */
+rrimage* read_image_with_compress_by_area_from_memory(
+        const unsigned char *buffer, size_t size,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate);
+
+rrimage* read_image_with_compress_by_area_from_memory_in_format(
+        const unsigned char *buffer, size_t size,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int format);
+
+/**
+ * 两步解码的第一步：只读取文件头，计算read_image_with_compress_by_area_into的输出大小
+ *
+ * @param format 输出像素格式PIXEL_FORMAT_*，解码模式DECODE_MODE_*不影响输出大小
+ * @param info 返回输出图片（旋转后）的宽高和每像素字节数，其他字段同probe_image
+ *
+ * @return 紧密排列时需要的缓冲区字节数，失败返回0
+ */
+size_t query_image_with_compress_by_area(const char *file_path,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int format, rrimage_info *info);
+
+size_t query_image_with_compress_by_area_from_memory(
+        const unsigned char *buffer, size_t size,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int format, rrimage_info *info);
+
+/**
+ * 同read_image_with_compress_by_area，但裁剪、缩放和旋转的结果直接写入调用方提供的缓冲区，
+ * 不分配rrimage和像素数据
+ *
+ * @param dest 输出缓冲区，大小可由query_image_with_compress_by_area得到
+ * @param info 不为NULL时返回实际输出的宽高和每像素字节数
+ *
+ * @return 成功返回1，缓冲区不足或解码失败返回0
+ */
+int read_image_with_compress_by_area_into(const char *file_path,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, rrimage_buffer *dest, rrimage_info *info);
+
+int read_image_with_compress_by_area_from_memory_into(
+        const unsigned char *buffer, size_t size,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, rrimage_buffer *dest, rrimage_info *info);
+
+/**
+ * jpeg转jpeg缩略图，参数同read_image_with_compress_by_area，结果按quality编码为jpeg（不超过原图质量）
+ *
+ * <p>
+ * 直接在YCbCr平面上裁剪、缩放和旋转后编码（色度为4:2:0），省去YCbCr与RGB之间的两次转换和色度的上下采样。
+ * CMYK等不支持的jpeg按RGB解码后编码。不缩放、按量化表估算的原图质量不高于quality且裁剪区域对齐iMCU时，
+ * 同transform_jpeg_by_area无损变换
+ * </p>
+ *
+ * @return 成功返回1，输入不是jpeg或解码编码失败返回0
+ */
+int transcode_jpeg_by_area(const char *in_file_path, const char *out_file_path,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int quality);
+
+/**
+ * 同transcode_jpeg_by_area，输入输出均在内存中，result->encode_time包含解码和编码的耗时
+ */
+int transcode_jpeg_by_area_from_memory(const unsigned char *buffer, size_t size,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int quality, rrimage_encoded *result);
+
+/**
+ * jpeg无损裁剪和旋转（同jpegtran），参数同read_image_with_compress_by_area，不缩放
+ *
+ * <p>
+ * 直接在DCT系数上镜像、转置和裁剪，不重新量化，比解码后重新编码快数倍且没有质量损失。
+ * 变换后裁剪区域的左边和上边必须对齐到iMCU（4:2:0时为16像素，灰度图为8像素）。
+ * transcode_jpeg_by_area不缩放且裁剪区域满足条件时也会使用无损变换
+ * </p>
+ *
+ * @return 成功返回1，输入不是jpeg、裁剪区域不对齐或解码编码失败返回0
+ */
+int transform_jpeg_by_area(const char *in_file_path, const char *out_file_path,
+        int x, int y, int w, int h, int rotate);
+
+/**
+ * 同transform_jpeg_by_area，输入输出均在内存中
+ */
+int transform_jpeg_by_area_from_memory(const unsigned char *buffer, size_t size,
+        int x, int y, int w, int h, int rotate, rrimage_encoded *result);
+
+// compress_jpeg_by_area的处理方式
+#define JPEG_DECISION_COPY 1 // 原图已满足要求，原样复制
+#define JPEG_DECISION_TRANSFORM 2 // 在DCT系数上无损旋转和裁剪
+#define JPEG_DECISION_ENCODE 3 // 解码后裁剪、缩放和旋转，按quality重新编码
+
+/**
+ * jpeg压缩策略：参数同transcode_jpeg_by_area，先读取文件头判断原图是否已经满足要求
+ *
+ * <p>
+ * 不旋转、不裁剪、按compress_method不需要缩小，且按量化表估算的原图质量不高于quality时，原样复制原图
+ * （文件使用copy_file_range/sendfile在内核中复制），不解码也不重新编码，同时保留EXIF等信息；
+ * 否则与transcode_jpeg_by_area相同，能无损变换时无损变换，不能时重新编码
+ * </p>
+ *
+ * @param decision 不为NULL时返回实际的处理方式JPEG_DECISION_*
+ * @return 成功返回1，输入不是jpeg或处理失败返回0
+ */
+int compress_jpeg_by_area(const char *in_file_path, const char *out_file_path,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int quality, int *decision);
+
+/**
+ * 同compress_jpeg_by_area，输入输出均在内存中，原样输出时result->buffer为原图数据的副本
+ */
+int compress_jpeg_by_area_from_memory(const unsigned char *buffer, size_t size,
+        COMPRESS_METHOD compress_method, int min_width, int x, int y, int w, int h,
+        int rotate, int quality, int *decision, rrimage_encoded *result);
+
+/**
+ * 同compress_jpeg_by_area，重新编码时按options编码，options为NULL时与compress_jpeg_by_area相同
+ *
+ * <p>
+ * 原样复制时不重新编码，options不起作用；无损变换时只有optimize_coding、progressive和restart_interval起作用
+ * （DCT系数和色度采样保持原图不变）。JPEG_SUBSAMPLING_444时按RGB解码后编码，不在YCbCr平面上直接处理
+ * </p>
+ */
+int compress_jpeg_by_area_with_options(const char *in_file_path,
+        const char *out_file_path, COMPRESS_METHOD compress_method,
+        int min_width, int x, int y, int w, int h, int rotate, int quality,
+        const rrimage_jpeg_options *options, int *decision);
+
+int compress_jpeg_by_area_from_memory_with_options(const unsigned char *buffer,
+        size_t size, COMPRESS_METHOD compress_method, int min_width, int x,
+        int y, int w, int h, int rotate, int quality,
+        const rrimage_jpeg_options *options, int *decision,
+        rrimage_encoded *result);
+
 /**
  * 图片压缩策略
  *